@@ -0,0 +1,316 @@
+#ifndef MINIRYS_GLOBAL_LOCALIZATION__CONSISTENCY_STATS_HPP_
+#define MINIRYS_GLOBAL_LOCALIZATION__CONSISTENCY_STATS_HPP_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <opencv2/core.hpp>
+#include "aruco.h"
+#include "minirys_global_localization/frame_log.hpp"
+
+/*
+ * Streaming statistics of marker poses used by detection_consistency_test.
+ * Every metric takes constant memory, however many frames are analyzed.
+ */
+
+// percentiles reported for every metric, 0 and 100 are min and max
+static const std::vector<double> PERCENTILES = {0, 50, 90, 95, 99, 100};
+static const std::vector<std::string> PERCENTILE_NAMES = {"min", "p50", "p90", "p95", "p99", "max"};
+
+// streaming percentile estimate with constant memory (P-square algorithm, Jain and Chlamtac 1985)
+class P2Quantile{
+	public:
+		P2Quantile(double p) : count(0){
+			p /= 100.0;
+			for (int i = 0; i < 5; i++) positions[i] = i;
+			double desired[5] = {0, 2*p, 4*p, 2 + 2*p, 4};
+			double increments[5] = {0, p/2, p, (1 + p)/2, 1};
+			for (int i = 0; i < 5; i++) {
+				desiredPositions[i] = desired[i];
+				desiredIncrements[i] = increments[i];
+			}
+			quantile = p;
+		}
+
+		void add(double value){
+			if (count < 5) {
+				heights[count++] = value;
+				std::sort(heights, heights + count);
+				return;
+			}
+			count++;
+
+			// find cell of new value, extreme markers follow min and max
+			int k;
+			if (value < heights[0]) {
+				heights[0] = value;
+				k = 0;
+			} else if (value >= heights[4]) {
+				heights[4] = value;
+				k = 3;
+			} else {
+				for (k = 0; k < 3 && value >= heights[k + 1]; k++) {}
+			}
+			for (int i = k + 1; i < 5; i++) positions[i]++;
+			for (int i = 0; i < 5; i++) desiredPositions[i] += desiredIncrements[i];
+
+			// move middle markers towards their desired positions
+			for (int i = 1; i < 4; i++) {
+				double d = desiredPositions[i] - positions[i];
+				if ((d >= 1 && positions[i + 1] - positions[i] > 1) || (d <= -1 && positions[i - 1] - positions[i] < -1)) {
+					int step = d > 0 ? 1 : -1;
+					double height = parabolic(i, step);
+					if (heights[i - 1] < height && height < heights[i + 1]) heights[i] = height;
+					else heights[i] += step*(heights[i + step] - heights[i])/(positions[i + step] - positions[i]);
+					positions[i] += step;
+				}
+			}
+		}
+
+		double value() const{
+			if (count == 0) return NAN;
+			if (count >= 5) return heights[2];
+			// exact interpolation between closest ranks until estimator is initialized
+			double rank = quantile*(count - 1);
+			int lower = std::floor(rank);
+			int upper = std::min(lower + 1, count - 1);
+			return heights[lower] + (rank - lower)*(heights[upper] - heights[lower]);
+		}
+
+	private:
+		int count;
+		double quantile;
+		double heights[5], positions[5], desiredPositions[5], desiredIncrements[5];
+
+		double parabolic(int i, int step) const{
+			return heights[i] + step/(positions[i + 1] - positions[i - 1])*(
+				(positions[i] - positions[i - 1] + step)*(heights[i + 1] - heights[i])/(positions[i + 1] - positions[i]) +
+				(positions[i + 1] - positions[i] - step)*(heights[i] - heights[i - 1])/(positions[i] - positions[i - 1]));
+		}
+};
+
+// streaming mean and variance (Welford), min, max and P-square estimates of PERCENTILES
+class StreamingStats{
+	public:
+		StreamingStats() : count(0), mean(0), m2(0), minimum(0), maximum(0){
+			for (auto p:PERCENTILES) {
+				if (p > 0 && p < 100) quantiles.push_back(P2Quantile(p));
+			}
+		}
+
+		void add(double value){
+			count++;
+			double delta = value - mean;
+			mean += delta/count;
+			m2 += delta*(value - mean);
+			minimum = count == 1 ? value : std::min(minimum, value);
+			maximum = count == 1 ? value : std::max(maximum, value);
+			for (auto &q:quantiles) q.add(value);
+		}
+
+		uint64_t get_count() const{ return count; }
+		double get_mean() const{ return mean; }
+		double get_stddev() const{ return count > 1 ? std::sqrt(m2/(count - 1)) : 0; }
+
+		// values for PERCENTILES, NaN when there are no samples
+		std::vector<double> get_percentiles() const{
+			std::vector<double> values;
+			if (count == 0) return std::vector<double>(PERCENTILES.size(), NAN);
+			unsigned int q = 0;
+			for (auto p:PERCENTILES) {
+				if (p <= 0) values.push_back(minimum);
+				else if (p >= 100) values.push_back(maximum);
+				else values.push_back(quantiles[q++].value());
+			}
+			return values;
+		}
+
+	private:
+		uint64_t count;
+		double mean, m2, minimum, maximum;
+		std::vector<P2Quantile> quantiles;
+};
+
+// rotation vector (Rodrigues) to unit quaternion w, x, y, z
+inline cv::Vec4d rotation_quaternion(const cv::Mat &Rvec){
+	double r[3] = {Rvec.at<float>(0,0), Rvec.at<float>(1,0), Rvec.at<float>(2,0)};
+	double angle = std::sqrt(r[0]*r[0] + r[1]*r[1] + r[2]*r[2]);
+	if (angle < 1e-12) return cv::Vec4d(1, 0, 0, 0);
+	double s = std::sin(angle/2)/angle;
+	return cv::Vec4d(std::cos(angle/2), r[0]*s, r[1]*s, r[2]*s);
+}
+
+// angle of rotation between two orientations, unlike rotation vector components it has no jump near pi
+inline double rotation_angle(const cv::Vec4d &a, const cv::Vec4d &b){
+	// relative rotation conj(a)*b
+	double w = a[0]*b[0] + a[1]*b[1] + a[2]*b[2] + a[3]*b[3];
+	double x = a[0]*b[1] - a[1]*b[0] - a[2]*b[3] + a[3]*b[2];
+	double y = a[0]*b[2] - a[2]*b[0] - a[3]*b[1] + a[1]*b[3];
+	double z = a[0]*b[3] - a[3]*b[0] - a[1]*b[2] + a[2]*b[1];
+	return 2*std::atan2(std::sqrt(x*x + y*y + z*z), std::fabs(w));
+}
+
+// observations of marker rotation used to choose the reference rotation
+static const size_t ROTATION_REFERENCE_FRAMES = 30;
+
+// angle between marker rotations and a reference rotation
+// reference is the observation closest to the others among the first ROTATION_REFERENCE_FRAMES,
+// so a first frame with flipped pose (planar marker ambiguity) does not offset the distribution
+class RotationDeviation{
+	public:
+		void add(const cv::Vec4d &orientation){
+			if (!candidates.empty() || stats.get_count() == 0) {
+				candidates.push_back(orientation);
+				if (candidates.size() >= ROTATION_REFERENCE_FRAMES) finish();
+				return;
+			}
+			stats.add(rotation_angle(reference, orientation));
+		}
+
+		// chooses reference from candidates collected so far and adds their angles
+		void finish(){
+			if (candidates.empty()) return;
+			double bestSum = INFINITY;
+			for (auto &candidate:candidates) {
+				double sum = 0;
+				for (auto &other:candidates) sum += rotation_angle(candidate, other);
+				if (sum < bestSum) {
+					bestSum = sum;
+					reference = candidate;
+				}
+			}
+			for (auto &candidate:candidates) stats.add(rotation_angle(reference, candidate));
+			candidates.clear();
+		}
+
+		// complete only after finish()
+		const StreamingStats &get_stats() const{ return stats; }
+
+	private:
+		std::vector<cv::Vec4d> candidates;
+		cv::Vec4d reference;
+		StreamingStats stats;
+};
+
+struct MarkerStats
+{
+	StreamingStats x, y, z, distance;
+	RotationDeviation rotation;
+};
+
+struct PairStats
+{
+	StreamingStats distance;
+	// angle of relative rotation between the two markers
+	StreamingStats rotation;
+};
+
+struct ConsistencyStats
+{
+	uint64_t frames = 0;
+	uint64_t framesWithMarkers = 0;
+	StreamingStats detectionTime;
+	std::map<int, MarkerStats> markers;
+	std::map<std::pair<int, int>, PairStats> pairs;
+
+	void add_frame(const std::vector<aruco::Marker> &Markers){
+		frames++;
+		std::vector<const aruco::Marker*> located;
+		for (auto &m:Markers) {
+			if (m.Tvec.total() == 3 && m.Rvec.total() == 3) located.push_back(&m);
+		}
+		if (!located.empty()) framesWithMarkers++;
+
+		for (auto m:located) {
+			MarkerStats &stats = markers[m->id];
+			stats.x.add(m->Tvec.at<float>(0,0));
+			stats.y.add(m->Tvec.at<float>(1,0));
+			stats.z.add(m->Tvec.at<float>(2,0));
+			stats.distance.add(cv::norm(m->Tvec));
+			stats.rotation.add(rotation_quaternion(m->Rvec));
+		}
+
+		// distance and relative rotation of every pair of markers, lower id first
+		for (unsigned int i = 0; i < located.size(); i++) {
+			for (unsigned int j = i + 1; j < located.size(); j++) {
+				const aruco::Marker *a = located[i], *b = located[j];
+				if (a->id > b->id) std::swap(a, b);
+				PairStats &stats = pairs[std::make_pair(a->id, b->id)];
+				stats.distance.add(cv::norm(a->Tvec, b->Tvec));
+				stats.rotation.add(rotation_angle(rotation_quaternion(a->Rvec), rotation_quaternion(b->Rvec)));
+			}
+		}
+	}
+
+	// has to be called before reading marker rotation statistics
+	void finish(){
+		for (auto &m:markers) m.second.rotation.finish();
+	}
+};
+
+// recorded marker sizes are compared with analyzed size with this tolerance, in meters
+static const float MARKER_SIZE_TOLERANCE = 1e-4;
+
+// groups recorded detection passes run with one marker size by frame
+// node runs a pass per marker size on every frame - passes of the same size on one frame are merged,
+// a pass that found nothing gives a frame without markers
+class RecordedDetections{
+	public:
+		RecordedDetections(float markerSize) : markerSize(markerSize), started(false), session(0), frameSequence(0), otherSizeRecords(0), unreferencedRecords(0) {}
+
+		// returns true and fills frameMarkers with previous frame when record starts a new frame
+		bool add(const FrameLogRecord &record, std::vector<aruco::Marker> &frameMarkers){
+			if (record.type != FrameLogRecordType::DETECTIONS_RECORD) return false;
+			if (std::fabs(record.markerSize - markerSize) > MARKER_SIZE_TOLERANCE) {
+				otherSizeRecords++;
+				return false;
+			}
+			if (record.frameSequence == FRAME_LOG_NO_FRAME) {
+				unreferencedRecords++;
+				return false;
+			}
+
+			bool completed = started && (record.session != session || record.frameSequence != frameSequence);
+			if (completed) {
+				frameMarkers = pending;
+				pending.clear();
+			}
+			started = true;
+			session = record.session;
+			frameSequence = record.frameSequence;
+
+			// same marker found by two passes of one frame is counted once
+			for (auto &m:record.markers) {
+				bool duplicate = false;
+				for (auto &p:pending) duplicate = duplicate || p.id == m.id;
+				if (!duplicate) pending.push_back(m);
+			}
+			return completed;
+		}
+
+		// returns true and fills frameMarkers with last frame
+		bool finish(std::vector<aruco::Marker> &frameMarkers){
+			if (!started) return false;
+			frameMarkers = pending;
+			pending.clear();
+			started = false;
+			return true;
+		}
+
+		uint64_t other_size_records() const{ return otherSizeRecords; }
+		uint64_t unreferenced_records() const{ return unreferencedRecords; }
+
+	private:
+		float markerSize;
+		bool started;
+		uint64_t session;
+		uint32_t frameSequence;
+		std::vector<aruco::Marker> pending;
+		uint64_t otherSizeRecords, unreferencedRecords;
+};
+
+#endif  // MINIRYS_GLOBAL_LOCALIZATION__CONSISTENCY_STATS_HPP_
@@ -0,0 +1,536 @@
+#ifndef MINIRYS_GLOBAL_LOCALIZATION__FRAME_LOG_HPP_
+#define MINIRYS_GLOBAL_LOCALIZATION__FRAME_LOG_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <opencv2/core.hpp>
+#include "aruco.h"
+
+/*
+ * Append-only binary log of camera frames, marker detections and output poses.
+ *
+ * Layout (native little-endian):
+ *   file header   - 8 byte magic "RYSLOG01", uint32 version, uint32 reserved
+ *   records       - FrameLogRecordHeader followed by payloadSize bytes of payload
+ *
+ * Opening an existing log appends a new session to it. Every session starts with
+ * a SESSION record, record and frame sequence numbers count from 0 within a session.
+ * Every record starts with its own magic - the reader skips a record torn by a crash
+ * by searching for the next magic, the writer cuts a torn tail off before appending.
+ *
+ * Payloads:
+ *   SESSION    - uint64 session id (wall clock time of opening in nanoseconds)
+ *   FRAME      - int32 rows, int32 cols, int32 cv type, uint32 row bytes, pixel data
+ *   DETECTIONS - uint32 frame sequence, uint32 marker count, float marker size the detection
+ *                was run with, marker count * 72 byte markers
+ *                (int32 id, float size, uint32 has pose, uint32 reserved,
+ *                 4 corners as float x/y, float Rvec[3], float Tvec[3])
+ *   POSE       - uint32 frame sequence, int32 localization status, float x, y, theta
+ */
+
+static const char FRAME_LOG_MAGIC[8] = {'R', 'Y', 'S', 'L', 'O', 'G', '0', '1'};
+static const uint32_t FRAME_LOG_VERSION = 2;
+static const uint32_t FRAME_LOG_RECORD_MAGIC = 0x4B4E4843; // "CHNK"
+static const uint32_t FRAME_LOG_NO_FRAME = 0xFFFFFFFF; // frame sequence of detections whose frame was dropped
+
+enum FrameLogRecordType
+{
+	FRAME_RECORD = 1,
+	DETECTIONS_RECORD = 2,
+	POSE_RECORD = 3,
+	SESSION_RECORD = 4,
+};
+
+struct FrameLogRecordHeader
+{
+	uint32_t magic;
+	uint16_t type;
+	uint16_t reserved;
+	uint32_t sequence;
+	uint32_t payloadSize;
+	int64_t timestampNs;
+};
+
+static const size_t FRAME_LOG_FILE_HEADER_SIZE = sizeof(FRAME_LOG_MAGIC) + 2*sizeof(uint32_t);
+static const size_t FRAME_LOG_FRAME_HEADER_SIZE = 4*sizeof(int32_t);
+static const size_t FRAME_LOG_DETECTIONS_HEADER_SIZE = 2*sizeof(uint32_t) + sizeof(float);
+static const size_t FRAME_LOG_MARKER_SIZE = 4*sizeof(int32_t) + 14*sizeof(float);
+static const size_t FRAME_LOG_POSE_SIZE = 2*sizeof(int32_t) + 3*sizeof(float);
+static const size_t FRAME_LOG_SESSION_SIZE = sizeof(uint64_t);
+
+// detections and poses are queued in a separate pool of small buffers, so they do not take frame buffers
+static const size_t FRAME_LOG_SMALL_BUFFERS_PER_FRAME = 4;
+static const size_t FRAME_LOG_SMALL_BUFFER_SIZE = 4096;
+
+// single record decoded from a log, frame data points into the mapped file
+struct FrameLogRecord
+{
+	FrameLogRecordType type;
+	uint64_t session;
+	uint32_t sequence;
+	int64_t timestampNs;
+	uint32_t frameSequence;
+	cv::Mat frame;
+	float markerSize;
+	std::vector<aruco::Marker> markers;
+	int status;
+	float x, y, theta;
+};
+
+class FrameLogReader{
+	public:
+		FrameLogReader() : fd(-1), data(nullptr), size(0), offset(0), validEnd(0), currentSession(0) {}
+
+		~FrameLogReader(){
+			close();
+		}
+
+		// maps whole log into memory, frames are decoded without copying
+		bool open(const std::string &path){
+			if (is_open()) return false;
+			fd = ::open(path.c_str(), O_RDONLY);
+			if (fd < 0) return false;
+
+			struct stat fileStat;
+			if (fstat(fd, &fileStat) != 0 || (size_t)fileStat.st_size < FRAME_LOG_FILE_HEADER_SIZE) {
+				close();
+				return false;
+			}
+			size = fileStat.st_size;
+
+			// private writable mapping - frames can be drawn on without touching the file
+			void *mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+			if (mapping == MAP_FAILED) {
+				close();
+				return false;
+			}
+			data = static_cast<uint8_t*>(mapping);
+			madvise(mapping, size, MADV_SEQUENTIAL);
+
+			uint32_t version;
+			std::memcpy(&version, data + sizeof(FRAME_LOG_MAGIC), sizeof(version));
+			if (std::memcmp(data, FRAME_LOG_MAGIC, sizeof(FRAME_LOG_MAGIC)) != 0 || version != FRAME_LOG_VERSION) {
+				close();
+				return false;
+			}
+			rewind();
+			return true;
+		}
+
+		void close(){
+			if (data != nullptr) munmap(data, size);
+			if (fd >= 0) ::close(fd);
+			fd = -1;
+			data = nullptr;
+			size = 0;
+			offset = 0;
+			validEnd = 0;
+			currentSession = 0;
+		}
+
+		bool is_open() const{
+			return data != nullptr;
+		}
+
+		void rewind(){
+			if (!is_open()) return;
+			offset = FRAME_LOG_FILE_HEADER_SIZE;
+			validEnd = FRAME_LOG_FILE_HEADER_SIZE;
+			currentSession = 0;
+		}
+
+		// decodes next record, skips damaged data, returns false at the end of log
+		bool next(FrameLogRecord &record){
+			while (is_open() && size - offset >= sizeof(FrameLogRecordHeader)) {
+				FrameLogRecordHeader header;
+				std::memcpy(&header, data + offset, sizeof(header));
+				if (!is_complete_record(header)) {
+					// record torn by a crash - continue from the next record magic
+					offset = find_record_magic(offset + 1);
+					continue;
+				}
+
+				uint8_t *payload = data + offset + sizeof(header);
+				offset += sizeof(header) + header.payloadSize;
+				validEnd = offset;
+
+				record.type = (FrameLogRecordType)header.type;
+				record.sequence = header.sequence;
+				record.timestampNs = header.timestampNs;
+				bool decoded = decode_payload(record, payload, header.payloadSize);
+				record.session = currentSession;
+				if (decoded) return true;
+				// unknown or malformed record type - skip it
+			}
+			return false;
+		}
+
+		// end of the last complete record read so far
+		size_t valid_size() const{
+			return validEnd;
+		}
+
+	private:
+		int fd;
+		uint8_t *data;
+		size_t size;
+		size_t offset;
+		size_t validEnd;
+		uint64_t currentSession;
+
+		// record fits in the file and is followed by end of file or another record
+		bool is_complete_record(const FrameLogRecordHeader &header) const{
+			if (header.magic != FRAME_LOG_RECORD_MAGIC || size - offset - sizeof(header) < header.payloadSize) return false;
+			size_t end = offset + sizeof(header) + header.payloadSize;
+			if (size - end < sizeof(FRAME_LOG_RECORD_MAGIC)) return true;
+			return std::memcmp(data + end, &FRAME_LOG_RECORD_MAGIC, sizeof(FRAME_LOG_RECORD_MAGIC)) == 0;
+		}
+
+		size_t find_record_magic(size_t from) const{
+			const uint8_t firstByte = FRAME_LOG_RECORD_MAGIC & 0xFF;
+			while (from + sizeof(FRAME_LOG_RECORD_MAGIC) <= size) {
+				const void *found = std::memchr(data + from, firstByte, size - from - sizeof(FRAME_LOG_RECORD_MAGIC) + 1);
+				if (found == nullptr) break;
+				from = static_cast<const uint8_t*>(found) - data;
+				if (std::memcmp(data + from, &FRAME_LOG_RECORD_MAGIC, sizeof(FRAME_LOG_RECORD_MAGIC)) == 0) return from;
+				from++;
+			}
+			return size;
+		}
+
+		bool decode_payload(FrameLogRecord &record, uint8_t *payload, size_t payloadSize){
+			switch (record.type) {
+				case FrameLogRecordType::FRAME_RECORD: {
+					if (payloadSize < FRAME_LOG_FRAME_HEADER_SIZE) return false;
+					int32_t frameHeader[3];
+					uint32_t rowBytes;
+					std::memcpy(frameHeader, payload, sizeof(frameHeader));
+					std::memcpy(&rowBytes, payload + sizeof(frameHeader), sizeof(rowBytes));
+					if (frameHeader[0] < 0 || frameHeader[1] < 0 || (size_t)frameHeader[1]*CV_ELEM_SIZE(frameHeader[2]) > rowBytes) return false;
+					if ((size_t)frameHeader[0]*rowBytes > payloadSize - FRAME_LOG_FRAME_HEADER_SIZE) return false;
+					record.frameSequence = record.sequence;
+					record.frame = cv::Mat(frameHeader[0], frameHeader[1], frameHeader[2], payload + FRAME_LOG_FRAME_HEADER_SIZE, rowBytes);
+					return true;
+				}
+				case FrameLogRecordType::DETECTIONS_RECORD: {
+					if (payloadSize < FRAME_LOG_DETECTIONS_HEADER_SIZE) return false;
+					uint32_t detectionsHeader[2];
+					std::memcpy(detectionsHeader, payload, sizeof(detectionsHeader));
+					if (detectionsHeader[1] > (payloadSize - FRAME_LOG_DETECTIONS_HEADER_SIZE)/FRAME_LOG_MARKER_SIZE) return false;
+					record.frameSequence = detectionsHeader[0];
+					std::memcpy(&record.markerSize, payload + sizeof(detectionsHeader), sizeof(record.markerSize));
+					record.markers.clear();
+					payload += FRAME_LOG_DETECTIONS_HEADER_SIZE;
+					for (uint32_t i = 0; i < detectionsHeader[1]; i++) {
+						int32_t markerHeader[4];
+						float values[14];
+						std::memcpy(markerHeader, payload, sizeof(markerHeader));
+						std::memcpy(values, payload + sizeof(markerHeader), sizeof(values));
+						payload += FRAME_LOG_MARKER_SIZE;
+
+						aruco::Marker m(markerHeader[0]);
+						std::memcpy(&m.ssize, &markerHeader[1], sizeof(float));
+						for (int c = 0; c < 4; c++) m.push_back(cv::Point2f(values[2*c], values[2*c + 1]));
+						if (markerHeader[2]) {
+							m.Rvec = cv::Mat(3, 1, CV_32FC1, &values[8]).clone();
+							m.Tvec = cv::Mat(3, 1, CV_32FC1, &values[11]).clone();
+						}
+						record.markers.push_back(m);
+					}
+					return true;
+				}
+				case FrameLogRecordType::SESSION_RECORD: {
+					if (payloadSize < FRAME_LOG_SESSION_SIZE) return false;
+					std::memcpy(&currentSession, payload, sizeof(currentSession));
+					return true;
+				}
+				case FrameLogRecordType::POSE_RECORD: {
+					if (payloadSize < FRAME_LOG_POSE_SIZE) return false;
+					int32_t poseHeader[2];
+					float pose[3];
+					std::memcpy(poseHeader, payload, sizeof(poseHeader));
+					std::memcpy(pose, payload + sizeof(poseHeader), sizeof(pose));
+					record.frameSequence = poseHeader[0];
+					record.status = poseHeader[1];
+					record.x = pose[0];
+					record.y = pose[1];
+					record.theta = pose[2];
+					return true;
+				}
+				default:
+					return false;
+			}
+		}
+};
+
+class FrameLogWriter{
+	public:
+		FrameLogWriter() : file(nullptr), stopping(false), frameBufferCount(0), nextSequence(0), session(0), writtenRecords(0), droppedRecords(0), writeErrors(0) {}
+
+		~FrameLogWriter(){
+			close();
+		}
+
+		// opens log for appending a new session and preallocates bufferCount frame buffers of bufferCapacity bytes each
+		// and FRAME_LOG_SMALL_BUFFERS_PER_FRAME small buffers per frame buffer for other records
+		bool open(const std::string &path, size_t bufferCount, size_t bufferCapacity){
+			if (is_open() || bufferCount == 0) return false;
+
+			// existing file has to be a log, torn tail left by a crash is cut off
+			struct stat fileStat;
+			if (stat(path.c_str(), &fileStat) == 0 && fileStat.st_size > 0) {
+				FrameLogReader reader;
+				if (!reader.open(path)) return false;
+				FrameLogRecord record;
+				while (reader.next(record)) {}
+				size_t validSize = reader.valid_size();
+				reader.close();
+				if (validSize < (size_t)fileStat.st_size && ::truncate(path.c_str(), validSize) != 0) return false;
+			}
+
+			file = std::fopen(path.c_str(), "ab");
+			if (file == nullptr) return false;
+			std::fseek(file, 0, SEEK_END);
+			bool headerWritten = true;
+			if (std::ftell(file) == 0) {
+				uint32_t fileHeader[2] = {FRAME_LOG_VERSION, 0};
+				headerWritten = std::fwrite(FRAME_LOG_MAGIC, sizeof(FRAME_LOG_MAGIC), 1, file) == 1 &&
+					std::fwrite(fileHeader, sizeof(fileHeader), 1, file) == 1;
+			}
+
+			// start new session
+			nextSequence = 0;
+			session = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+			FrameLogRecordHeader header = make_header(SESSION_RECORD, session, FRAME_LOG_SESSION_SIZE, nextSequence++);
+			if (!headerWritten ||
+				std::fwrite(&header, sizeof(header), 1, file) != 1 ||
+				std::fwrite(&session, sizeof(session), 1, file) != 1 ||
+				std::fflush(file) != 0) {
+				std::fclose(file);
+				file = nullptr;
+				return false;
+			}
+
+			frameBufferCount = bufferCount;
+			buffers.assign(bufferCount*(1 + FRAME_LOG_SMALL_BUFFERS_PER_FRAME), Buffer());
+			freeFrameBuffers.clear();
+			freeSmallBuffers.clear();
+			pendingBuffers.clear();
+			for (size_t i = 0; i < buffers.size(); i++) {
+				buffers[i].data.resize(i < frameBufferCount ? bufferCapacity : FRAME_LOG_SMALL_BUFFER_SIZE);
+				buffers[i].size = 0;
+				(i < frameBufferCount ? freeFrameBuffers : freeSmallBuffers).push_back(i);
+			}
+
+			stopping = false;
+			writerThread = std::thread(&FrameLogWriter::write_loop, this);
+			return true;
+		}
+
+		// writes out all queued records and closes the log
+		void close(){
+			if (!is_open()) return;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			condition.notify_one();
+			writerThread.join();
+			std::fclose(file);
+			file = nullptr;
+		}
+
+		bool is_open() const{
+			return file != nullptr;
+		}
+
+		// buffer size needed to record a frame of given size and type
+		static size_t frame_record_size(int rows, int cols, int type){
+			return sizeof(FrameLogRecordHeader) + FRAME_LOG_FRAME_HEADER_SIZE + (size_t)rows*cols*CV_ELEM_SIZE(type);
+		}
+
+		// copies frame into a free buffer, returns its sequence number or -1 when the record was dropped
+		int64_t record_frame(int64_t timestampNs, const cv::Mat &frame){
+			uint32_t rowBytes = frame.cols*frame.elemSize();
+			size_t payloadSize = FRAME_LOG_FRAME_HEADER_SIZE + rowBytes*frame.rows;
+			uint32_t sequence;
+			int index = acquire_buffer(FRAME_RECORD, timestampNs, payloadSize, sequence);
+			if (index < 0) return -1;
+
+			uint8_t *payload = buffers[index].data.data() + sizeof(FrameLogRecordHeader);
+			int32_t frameHeader[3] = {frame.rows, frame.cols, frame.type()};
+			std::memcpy(payload, frameHeader, sizeof(frameHeader));
+			std::memcpy(payload + sizeof(frameHeader), &rowBytes, sizeof(rowBytes));
+			payload += FRAME_LOG_FRAME_HEADER_SIZE;
+			for (int r = 0; r < frame.rows; r++) {
+				std::memcpy(payload + r*rowBytes, frame.ptr(r), rowBytes);
+			}
+
+			submit_buffer(index);
+			return sequence;
+		}
+
+		// markerSize is the size detection was run with, stored also when no marker was found
+		bool record_detections(int64_t timestampNs, uint32_t frameSequence, float markerSize, const std::vector<aruco::Marker> &markers){
+			size_t payloadSize = FRAME_LOG_DETECTIONS_HEADER_SIZE + markers.size()*FRAME_LOG_MARKER_SIZE;
+			uint32_t sequence;
+			int index = acquire_buffer(DETECTIONS_RECORD, timestampNs, payloadSize, sequence);
+			if (index < 0) return false;
+
+			uint8_t *payload = buffers[index].data.data() + sizeof(FrameLogRecordHeader);
+			uint32_t detectionsHeader[2] = {frameSequence, (uint32_t)markers.size()};
+			std::memcpy(payload, detectionsHeader, sizeof(detectionsHeader));
+			std::memcpy(payload + sizeof(detectionsHeader), &markerSize, sizeof(markerSize));
+			payload += FRAME_LOG_DETECTIONS_HEADER_SIZE;
+			for (auto &m:markers) {
+				bool hasPose = m.Rvec.total() == 3 && m.Tvec.total() == 3;
+				int32_t markerHeader[4] = {m.id, 0, hasPose, 0};
+				float values[14] = {0};
+				for (unsigned int c = 0; c < 4 && c < m.size(); c++) {
+					values[2*c] = m[c].x;
+					values[2*c + 1] = m[c].y;
+				}
+				if (hasPose) {
+					for (int k = 0; k < 3; k++) {
+						values[8 + k] = m.Rvec.ptr<float>(0)[k];
+						values[11 + k] = m.Tvec.ptr<float>(0)[k];
+					}
+				}
+				std::memcpy(&markerHeader[1], &m.ssize, sizeof(float));
+				std::memcpy(payload, markerHeader, sizeof(markerHeader));
+				std::memcpy(payload + sizeof(markerHeader), values, sizeof(values));
+				payload += FRAME_LOG_MARKER_SIZE;
+			}
+
+			submit_buffer(index);
+			return true;
+		}
+
+		bool record_pose(int64_t timestampNs, uint32_t frameSequence, int status, float x, float y, float theta){
+			uint32_t sequence;
+			int index = acquire_buffer(POSE_RECORD, timestampNs, FRAME_LOG_POSE_SIZE, sequence);
+			if (index < 0) return false;
+
+			uint8_t *payload = buffers[index].data.data() + sizeof(FrameLogRecordHeader);
+			int32_t poseHeader[2] = {(int32_t)frameSequence, status};
+			float pose[3] = {x, y, theta};
+			std::memcpy(payload, poseHeader, sizeof(poseHeader));
+			std::memcpy(payload + sizeof(poseHeader), pose, sizeof(pose));
+
+			submit_buffer(index);
+			return true;
+		}
+
+		uint64_t session_id() const{ return session; }
+		uint64_t written_records() const{ return writtenRecords; }
+		uint64_t dropped_records() const{ return droppedRecords; }
+		uint64_t write_errors() const{ return writeErrors; }
+
+	private:
+		struct Buffer
+		{
+			std::vector<uint8_t> data;
+			size_t size;
+		};
+
+		std::FILE *file;
+		std::thread writerThread;
+		std::mutex mutex;
+		std::condition_variable condition;
+		bool stopping;
+
+		// frame buffers first, small buffers after them
+		std::vector<Buffer> buffers;
+		size_t frameBufferCount;
+		std::vector<size_t> freeFrameBuffers, freeSmallBuffers;
+		std::deque<size_t> pendingBuffers;
+		uint32_t nextSequence;
+		uint64_t session;
+
+		std::atomic<uint64_t> writtenRecords, droppedRecords, writeErrors;
+
+		// takes a free buffer from pool matching record size and fills in record header,
+		// never blocks - record is dropped when all buffers of the pool are queued
+		int acquire_buffer(FrameLogRecordType type, int64_t timestampNs, size_t payloadSize, uint32_t &sequence){
+			if (!is_open()) return -1;
+			size_t index;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				bool small = type != FRAME_RECORD && sizeof(FrameLogRecordHeader) + payloadSize <= FRAME_LOG_SMALL_BUFFER_SIZE;
+				std::vector<size_t> &freeBuffers = small ? freeSmallBuffers : freeFrameBuffers;
+				if (freeBuffers.empty()) {
+					droppedRecords++;
+					return -1;
+				}
+				index = freeBuffers.back();
+				freeBuffers.pop_back();
+				sequence = nextSequence++;
+			}
+
+			Buffer &buffer = buffers[index];
+			buffer.size = sizeof(FrameLogRecordHeader) + payloadSize;
+			// grows only when a record exceeds preallocated capacity
+			if (buffer.data.size() < buffer.size) buffer.data.resize(buffer.size);
+
+			FrameLogRecordHeader header = make_header(type, timestampNs, payloadSize, sequence);
+			std::memcpy(buffer.data.data(), &header, sizeof(header));
+			return index;
+		}
+
+		static FrameLogRecordHeader make_header(FrameLogRecordType type, int64_t timestampNs, size_t payloadSize, uint32_t sequence){
+			FrameLogRecordHeader header;
+			header.magic = FRAME_LOG_RECORD_MAGIC;
+			header.type = type;
+			header.reserved = 0;
+			header.sequence = sequence;
+			header.payloadSize = payloadSize;
+			header.timestampNs = timestampNs;
+			return header;
+		}
+
+		void submit_buffer(size_t index){
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				pendingBuffers.push_back(index);
+			}
+			condition.notify_one();
+		}
+
+		void write_loop(){
+			std::unique_lock<std::mutex> lock(mutex);
+			while (true) {
+				condition.wait(lock, [this]{ return stopping || !pendingBuffers.empty(); });
+				if (pendingBuffers.empty()) break;
+				size_t index = pendingBuffers.front();
+				pendingBuffers.pop_front();
+				lock.unlock();
+
+				if (std::fwrite(buffers[index].data.data(), buffers[index].size, 1, file) == 1) writtenRecords++;
+				else writeErrors++;
+
+				lock.lock();
+				(index < frameBufferCount ? freeFrameBuffers : freeSmallBuffers).push_back(index);
+				// flush whenever the queue drains, so a crash loses as little as possible
+				if (pendingBuffers.empty()) {
+					lock.unlock();
+					std::fflush(file);
+					lock.lock();
+				}
+			}
+		}
+};
+
+#endif  // MINIRYS_GLOBAL_LOCALIZATION__FRAME_LOG_HPP_
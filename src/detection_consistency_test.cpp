@@ -1,118 +1,304 @@
 #include <iostream>
+#include <fstream>
 #include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 #include "aruco.h"
 // #include "markerdetector.h"
 #include "FlyCapture2.h"
+#include "minirys_global_localization/frame_log.hpp"
+#include "minirys_global_localization/consistency_stats.hpp"
 using namespace  std;
 
-int main(int argc, char const *argv[])
+// consecutive failed grabs after which camera is considered lost
+static const int MAX_CAPTURE_FAILURES = 100;
+
+struct StatsRow
 {
-	FlyCapture2::Error error;
-	FlyCapture2::Camera camera;
-	FlyCapture2::CameraInfo camInfo;
-
-	// Connect the camera
-	error = camera.Connect( 0 );
-	if ( error != FlyCapture2::PGRERROR_OK )
-	{
-		printf("%s\n", error.GetDescription());
-		std::cout << "Failed to connect to camera" << std::endl;     
-		return false;
+	string kind, id, metric;
+	const StreamingStats *stats;
+};
+
+vector<StatsRow> collect_rows(const ConsistencyStats &consistency){
+	vector<StatsRow> rows;
+	if (consistency.detectionTime.get_count() > 0) rows.push_back({"timing", "all", "detection_ms", &consistency.detectionTime});
+	for (auto &m:consistency.markers) {
+		string id = to_string(m.first);
+		rows.push_back({"marker", id, "x", &m.second.x});
+		rows.push_back({"marker", id, "y", &m.second.y});
+		rows.push_back({"marker", id, "z", &m.second.z});
+		rows.push_back({"marker", id, "distance", &m.second.distance});
+		rows.push_back({"marker", id, "rotation_angle", &m.second.rotation.get_stats()});
 	}
+	for (auto &p:consistency.pairs) {
+		string id = to_string(p.first.first) + "-" + to_string(p.first.second);
+		rows.push_back({"pair", id, "distance", &p.second.distance});
+		rows.push_back({"pair", id, "rotation_angle", &p.second.rotation});
+	}
+	return rows;
+}
 
-	// Get the camera info and print it out
-	error = camera.GetCameraInfo( &camInfo );
-	if ( error != FlyCapture2::PGRERROR_OK )
-	{
-		printf("%s\n", error.GetDescription());
-		std::cout << "Failed to get camera info from camera" << std::endl;     
-		return false;
+void write_csv(ostream &out, const ConsistencyStats &consistency){
+	out << "kind,id,metric,count,frames,mean,stddev";
+	for (auto &name:PERCENTILE_NAMES) out << "," << name;
+	out << "\n";
+	out.precision(9);
+	for (auto &row:collect_rows(consistency)) {
+		out << row.kind << "," << row.id << "," << row.metric << ","
+			<< row.stats->get_count() << "," << consistency.frames;
+		// metric without samples has empty values
+		if (row.stats->get_count() == 0) {
+			for (unsigned int i = 0; i < PERCENTILES.size() + 2; i++) out << ",";
+		} else {
+			out << "," << row.stats->get_mean() << "," << row.stats->get_stddev();
+			for (auto value:row.stats->get_percentiles()) out << "," << value;
+		}
+		out << "\n";
 	}
-	std::cout << "Camera information: "
-			  << camInfo.vendorName << " "
-			  << camInfo.modelName << " " 
-			  << camInfo.serialNumber << std::endl;
-	
-	error = camera.StartCapture();
-	if ( error == FlyCapture2::PGRERROR_ISOCH_BANDWIDTH_EXCEEDED )
-	{
-		printf("%s\n", error.GetDescription());
-		std::cout << "Bandwidth exceeded" << std::endl;     
-		return false;
+}
+
+void write_json(ostream &out, const ConsistencyStats &consistency){
+	out.precision(9);
+	out << "{\n  \"frames\": " << consistency.frames
+		<< ",\n  \"frames_with_markers\": " << consistency.framesWithMarkers
+		<< ",\n  \"stats\": [";
+	vector<StatsRow> rows = collect_rows(consistency);
+	for (unsigned int i = 0; i < rows.size(); i++) {
+		out << (i ? ",\n" : "\n") << "    {\"kind\": \"" << rows[i].kind << "\", \"id\": \"" << rows[i].id
+			<< "\", \"metric\": \"" << rows[i].metric << "\", \"count\": " << rows[i].stats->get_count();
+		// metric without samples has null values
+		bool empty = rows[i].stats->get_count() == 0;
+		out << ", \"mean\": ";
+		if (empty) out << "null";
+		else out << rows[i].stats->get_mean();
+		out << ", \"stddev\": ";
+		if (empty) out << "null";
+		else out << rows[i].stats->get_stddev();
+		vector<double> values;
+		if (!empty) values = rows[i].stats->get_percentiles();
+		for (unsigned int p = 0; p < PERCENTILES.size(); p++) {
+			out << ", \"" << PERCENTILE_NAMES[p] << "\": ";
+			if (empty) out << "null";
+			else out << values[p];
+		}
+		out << "}";
 	}
-	else if ( error != FlyCapture2::PGRERROR_OK )
-	{
-		printf("%s\n", error.GetDescription());
-		std::cout << "Failed to start image capture" << std::endl;     
-		return false;
+	out << "\n  ]\n}\n";
+}
+
+void print_usage(const char *name){
+	std::cout << "Usage: " << name << " <camera_calibration.yml> [options]\n"
+			  << "  --frames N         number of frames to analyze, 0 - whole log (default 1000 from camera, 0 from log)\n"
+			  << "  --marker-size S    marker size in meters (default 0.163)\n"
+			  << "  --dictionary D     aruco dictionary (default ARUCO_MIP_36h12)\n"
+			  << "  --mode M           detection mode: normal, fast, video_fast (default normal)\n"
+			  << "  --log FILE         replay frames from recorder log instead of camera\n"
+			  << "  --recorded         with --log, use recorded detections instead of detecting again,\n"
+			  << "                     only detection passes run with --marker-size are analyzed\n"
+			  << "  --csv FILE         write statistics as CSV (default stdout)\n"
+			  << "  --json FILE        write statistics as JSON\n"
+			  << "  --show             display frames with detected markers\n"
+			  << "Marker rotation_angle is measured from the observation closest to the others among first "
+			  << ROTATION_REFERENCE_FRAMES << " frames of the marker,\n"
+			  << "pair rotation_angle is the angle between rotations of the two markers." << std::endl;
+}
+
+int main(int argc, char const *argv[])
+{
+	if (argc < 2 || argv[1][0] == '-') {
+		print_usage(argv[0]);
+		return 1;
 	}
 
-	// set detection parameters (dictionary, camera parameters, markersize, ...) and detect markers on image
+	// parse options
+	long frameLimit = -1;
+	float MarkerSize = 0.163;
+	string dictionary = "ARUCO_MIP_36h12", mode = "normal", logFile, csvFile, jsonFile;
+	bool useRecorded = false, show = false;
+	for (int i = 2; i < argc; i++) {
+		bool hasValue = i < argc - 1;
+		if (!strcmp(argv[i], "--frames") && hasValue) frameLimit = atol(argv[++i]);
+		else if (!strcmp(argv[i], "--marker-size") && hasValue) MarkerSize = atof(argv[++i]);
+		else if (!strcmp(argv[i], "--dictionary") && hasValue) dictionary = argv[++i];
+		else if (!strcmp(argv[i], "--mode") && hasValue) mode = argv[++i];
+		else if (!strcmp(argv[i], "--log") && hasValue) logFile = argv[++i];
+		else if (!strcmp(argv[i], "--csv") && hasValue) csvFile = argv[++i];
+		else if (!strcmp(argv[i], "--json") && hasValue) jsonFile = argv[++i];
+		else if (!strcmp(argv[i], "--recorded")) useRecorded = true;
+		else if (!strcmp(argv[i], "--show")) show = true;
+		else {
+			std::cerr << "Unknown option " << argv[i] << std::endl;
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (frameLimit < 0) frameLimit = logFile.empty() ? 1000 : 0;
+	if (frameLimit == 0 && logFile.empty()) {
+		std::cerr << "Number of frames has to be given when analyzing camera frames" << std::endl;
+		return 1;
+	}
+
+	// set detection parameters (dictionary, camera parameters, markersize, ...)
 	aruco::MarkerDetector MDetector;
-	MDetector.setDictionary("ARUCO_MIP_36h12", 0.f);
-	aruco::CameraParameters CamParam;
-	if (argc > 1) {
-		CamParam.readFromXMLFile(argv[1]);
+	MDetector.setDictionary(dictionary, 0.f);
+	if (mode == "fast") MDetector.setDetectionMode(aruco::DM_FAST);
+	else if (mode == "video_fast") MDetector.setDetectionMode(aruco::DM_VIDEO_FAST);
+	else if (mode != "normal") {
+		std::cerr << "Unknown detection mode " << mode << std::endl;
+		return 1;
 	}
-	// float MarkerSize = 0.0385;
-	float MarkerSize = 0.163;
+	aruco::CameraParameters CamParam;
+	CamParam.readFromXMLFile(argv[1]);
+
+	ConsistencyStats consistency;
 	vector<aruco::Marker> Markers;
+	bool captureFailed = false;
 
-	// image objects
-	FlyCapture2::Image rawImage;
-	FlyCapture2::Image rgbImage;
+	// detects markers on frame and accumulates statistics
+	auto analyze_frame = [&](cv::Mat &InImage){
+		auto start = chrono::steady_clock::now();
+		Markers = MDetector.detect(InImage, CamParam, MarkerSize);
+		consistency.detectionTime.add(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+		consistency.add_frame(Markers);
 
-	for (unsigned int i = 0; i < 10; i++){
+		if (show) {
+			for(auto m:Markers){
+				m.draw(InImage, cv::Scalar(0, 0, 255), 2);
+			}
+			cv::imshow("image_with_markers_detected", InImage);
+			cv::waitKey(1);
+		}
+	};
 
-		// retrieve image from camera
-		error = camera.RetrieveBuffer( &rawImage );
+	if (!logFile.empty()) {
+		// replay frames from recorder log
+		FrameLogReader reader;
+		if (!reader.open(logFile)) {
+			std::cerr << "Failed to open log " << logFile << std::endl;
+			return 1;
+		}
+		FrameLogRecord record;
+
+		RecordedDetections recorded(MarkerSize);
+		vector<aruco::Marker> frameMarkers;
+		while ((frameLimit == 0 || (long)consistency.frames < frameLimit) && reader.next(record)) {
+			if (!useRecorded) {
+				if (record.type == FrameLogRecordType::FRAME_RECORD) analyze_frame(record.frame);
+			}
+			else if (recorded.add(record, frameMarkers)) consistency.add_frame(frameMarkers);
+		}
+		if (useRecorded && (frameLimit == 0 || (long)consistency.frames < frameLimit) && recorded.finish(frameMarkers))
+			consistency.add_frame(frameMarkers);
+		if (useRecorded && (recorded.other_size_records() || recorded.unreferenced_records())) {
+			std::cerr << "Skipped " << recorded.other_size_records() << " detection records of other marker sizes and "
+					  << recorded.unreferenced_records() << " detection records of dropped frames" << std::endl;
+		}
+	} else {
+		FlyCapture2::Error error;
+		FlyCapture2::Camera camera;
+		FlyCapture2::CameraInfo camInfo;
+
+		// Connect the camera
+		error = camera.Connect( 0 );
 		if ( error != FlyCapture2::PGRERROR_OK )
 		{
-			printf("%s\n", error.GetDescription());
-			std::cout << "capture error" << std::endl;
-			continue;
+			std::cerr << error.GetDescription() << "\n" << "Failed to connect to camera" << std::endl;
+			return 1;
+		}
+
+		// Get the camera info and print it out
+		error = camera.GetCameraInfo( &camInfo );
+		if ( error != FlyCapture2::PGRERROR_OK )
+		{
+			std::cerr << error.GetDescription() << "\n" << "Failed to get camera info from camera" << std::endl;
+			return 1;
+		}
+		std::cerr << "Camera information: "
+				  << camInfo.vendorName << " "
+				  << camInfo.modelName << " "
+				  << camInfo.serialNumber << std::endl;
+
+		error = camera.StartCapture();
+		if ( error == FlyCapture2::PGRERROR_ISOCH_BANDWIDTH_EXCEEDED )
+		{
+			std::cerr << error.GetDescription() << "\n" << "Bandwidth exceeded" << std::endl;
+			return 1;
+		}
+		else if ( error != FlyCapture2::PGRERROR_OK )
+		{
+			std::cerr << error.GetDescription() << "\n" << "Failed to start image capture" << std::endl;
+			return 1;
 		}
 
-		// convert image to rgb from greyscale
-		rawImage.Convert( FlyCapture2::PIXEL_FORMAT_BGR, &rgbImage );
+		// image objects
+		FlyCapture2::Image rawImage;
+		FlyCapture2::Image rgbImage;
+		int captureFailures = 0;
 
-		// convert to opencv Mat object
-		unsigned int rowBytes = (double)rgbImage.GetReceivedDataSize()/(double)rgbImage.GetRows();       
-		cv::Mat InImage = cv::Mat(rgbImage.GetRows(), rgbImage.GetCols(), CV_8UC3, rgbImage.GetData(),rowBytes);
+		while (frameLimit == 0 || (long)consistency.frames < frameLimit) {
 
-		// detect markers
-		Markers = MDetector.detect(InImage, CamParam, MarkerSize);
+			// retrieve image from camera
+			error = camera.RetrieveBuffer( &rawImage );
+			if ( error != FlyCapture2::PGRERROR_OK )
+			{
+				std::cerr << error.GetDescription() << "\ncapture error" << std::endl;
+				if (++captureFailures >= MAX_CAPTURE_FAILURES) {
+					std::cerr << "Capture failed " << captureFailures << " times in a row, stopping" << std::endl;
+					captureFailed = true;
+					break;
+				}
+				continue;
+			}
+			captureFailures = 0;
 
-		// draw markers on image
-		for(auto m:Markers){
-			m.draw(InImage, cv::Scalar(0, 0, 255), 2);
-		}
+			// convert image to rgb from greyscale
+			rawImage.Convert( FlyCapture2::PIXEL_FORMAT_BGR, &rgbImage );
+
+			// convert to opencv Mat object
+			unsigned int rowBytes = (double)rgbImage.GetReceivedDataSize()/(double)rgbImage.GetRows();
+			cv::Mat InImage = cv::Mat(rgbImage.GetRows(), rgbImage.GetCols(), CV_8UC3, rgbImage.GetData(),rowBytes);
 
-    float distance = 0;
-    for (unsigned int i = 0; i < Markers.size() - 1; i++) {
-    	for (unsigned int j = i + 1; j < Markers.size(); j++) {
-		    distance = sqrt(pow(Markers[i].Tvec.at<float>(0,0) - Markers[j].Tvec.at<float>(0,0), 2) + pow(Markers[i].Tvec.at<float>(1,0) - Markers[j].Tvec.at<float>(1,0), 2) + pow(Markers[i].Tvec.at<float>(2,0) - Markers[j].Tvec.at<float>(2,0), 2));
-		    cout << "Distance between markers " << Markers[i].id << " and " << Markers[j].id << ": " << distance << endl;
+			analyze_frame(InImage);
 		}
-    }
 
-		// show image
-		cv::imshow("image_with_markers_detected",InImage);
-		cv::waitKey(0);
+		// stop the camera
+		error = camera.StopCapture();
+		if ( error != FlyCapture2::PGRERROR_OK )
+		{
+			// This may fail when the camera was removed, so don't show 
+			// an error message
+		}  
+		camera.Disconnect();
+	}
 
+	// write statistics
+	consistency.finish();
+	std::cerr << "Analyzed " << consistency.frames << " frames, markers located on " << consistency.framesWithMarkers << std::endl;
+	if (csvFile.empty()) write_csv(std::cout, consistency);
+	else {
+		ofstream csv(csvFile);
+		write_csv(csv, consistency);
+		if (!csv) {
+			std::cerr << "Failed to write " << csvFile << std::endl;
+			return 1;
+		}
+	}
+	if (!jsonFile.empty()) {
+		ofstream json(jsonFile);
+		write_json(json, consistency);
+		if (!json) {
+			std::cerr << "Failed to write " << jsonFile << std::endl;
+			return 1;
+		}
 	}
 
-	// stop the camera
-	error = camera.StopCapture();
-	if ( error != FlyCapture2::PGRERROR_OK )
-	{
-		// This may fail when the camera was removed, so don't show 
-		// an error message
-	}  
-	camera.Disconnect();
-
-	return 0;
-}
\ No newline at end of file
+	return captureFailed ? 1 : 0;
+}
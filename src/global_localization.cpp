@@ -6,6 +6,9 @@
 #include <opencv2/core.hpp>
 #include <opencv2/calib3d.hpp>
 #include <string>
+#include <algorithm>
+#include <cinttypes>
+#include "minirys_global_localization/frame_log.hpp"
 
 enum LocalizationStatus
 {
@@ -41,10 +44,9 @@ class GlobalLocalizationNode : public rclcpp::Node{
 			for (i = params_file.length()-1; i >= 0; i--){
 				if (params_file[i] == '/') break;
 			}
-			if (i > 0){
-				params_file.erase(params_file.begin()+i+1, params_file.end());
-				camera_params_file = params_file + this->get_parameter("camera_parameters_file").get_value<std::string>();
-			} else camera_params_file = this->get_parameter("camera_parameters_file").get_value<std::string>();
+			std::string params_dir = "";
+			if (i > 0) params_dir = params_file.substr(0, i+1);
+			camera_params_file = params_dir + this->get_parameter("camera_parameters_file").get_value<std::string>();
 			cameraParameters.readFromXMLFile(camera_params_file);
 			
 			// set marker dictionary
@@ -66,6 +68,25 @@ class GlobalLocalizationNode : public rclcpp::Node{
 			// wait for image consistency purposes - photo taken roght after the capture starts tends to be extremely bright or dim
 			std::this_thread::sleep_for(std::chrono::seconds(1));
 
+			// open recorder log - frames, detections and poses are written by a background thread
+			this->declare_parameter("recorder_enabled", rclcpp::ParameterValue(false));
+			this->declare_parameter("recorder_file", rclcpp::ParameterValue("global_localization.ryslog"));
+			this->declare_parameter("recorder_buffer_count", rclcpp::ParameterValue(8));
+			this->declare_parameter("recorder_buffer_size", rclcpp::ParameterValue(0));
+			lastFrameSequence = FRAME_LOG_NO_FRAME;
+			if (this->get_parameter("recorder_enabled").get_value<bool>()) {
+				std::string recorder_file = this->get_parameter("recorder_file").get_value<std::string>();
+				if (recorder_file.empty() || recorder_file[0] != '/') recorder_file = params_dir + recorder_file;
+				int64_t buffer_count = std::max<int64_t>(0, this->get_parameter("recorder_buffer_count").get_value<int64_t>());
+				int64_t buffer_size = std::max<int64_t>(0, this->get_parameter("recorder_buffer_size").get_value<int64_t>());
+				// size buffers from camera resolution, so no allocation happens while capturing
+				if (buffer_size == 0 && take_photo() == LocalizationStatus::OK)
+					buffer_size = FrameLogWriter::frame_record_size(inImage.rows, inImage.cols, inImage.type());
+				if (frameLog.open(recorder_file, buffer_count, buffer_size))
+					RCLCPP_INFO(this->get_logger(), "Recording to %s, session %" PRIu64, recorder_file.c_str(), frameLog.session_id());
+				else RCLCPP_ERROR(this->get_logger(), "Failed to open recorder file %s", recorder_file.c_str());
+			}
+
 			//initialize point 0,0,0 (usefull for calculating location) and robot position point
 			point0 = cv::Mat::zeros(4, 1, CV_32FC1);
 			point0.at<float>(3, 0) = 1;
@@ -91,6 +112,13 @@ class GlobalLocalizationNode : public rclcpp::Node{
 			RCLCPP_INFO(this->get_logger(), "Stopping the camera...");
 			camera.StopCapture();
 			camera.Disconnect();
+
+			// write out queued records
+			if (frameLog.is_open()) {
+				frameLog.close();
+				RCLCPP_INFO(this->get_logger(), "Recorder stopped: %" PRIu64 " records written, %" PRIu64 " dropped, %" PRIu64 " write errors",
+					frameLog.written_records(), frameLog.dropped_records(), frameLog.write_errors());
+			}
 		}
 
 	private:
@@ -111,6 +139,9 @@ class GlobalLocalizationNode : public rclcpp::Node{
 		aruco::MarkerDetector markerDetector;
 		aruco::CameraParameters cameraParameters;
 
+		FrameLogWriter frameLog;
+		uint32_t lastFrameSequence;
+
 		void get_robot_localization(
 					const std::shared_ptr<minirys_interfaces::srv::GetMinirysGlobalLocalization::Request> request,
 					std::shared_ptr<minirys_interfaces::srv::GetMinirysGlobalLocalization::Response> response) {
@@ -142,6 +173,7 @@ class GlobalLocalizationNode : public rclcpp::Node{
 					response->x = 999999;
 					response->y = 999999;
 					response->theta = 999999;
+					if (frameLog.is_open()) frameLog.record_pose(this->now().nanoseconds(), lastFrameSequence, status, response->x, response->y, response->theta);
 					return;
 			}
 
@@ -151,9 +183,12 @@ class GlobalLocalizationNode : public rclcpp::Node{
 			response->x = robotPosition.at<float>(0, 0);
 			response->y = robotPosition.at<float>(1, 0);
 			response->theta = robotEulerRotations[2];
+			if (frameLog.is_open()) frameLog.record_pose(this->now().nanoseconds(), lastFrameSequence, status, response->x, response->y, response->theta);
 		}
 
 		int take_photo(){
+			lastFrameSequence = FRAME_LOG_NO_FRAME;
+
 			// grab image from camera
 			cameraError = camera.RetrieveBuffer( &rawImage );
 			if ( cameraError != FlyCapture2::PGRERROR_OK )
@@ -168,6 +203,12 @@ class GlobalLocalizationNode : public rclcpp::Node{
 			// convert to opencv Mat object
 			unsigned int rowBytes = (double)rgbImage.GetReceivedDataSize()/(double)rgbImage.GetRows();       
 			inImage = cv::Mat(rgbImage.GetRows(), rgbImage.GetCols(), CV_8UC3, rgbImage.GetData(),rowBytes);
+
+			// copy frame to recorder, detections of a dropped frame are recorded without frame reference
+			if (frameLog.is_open()) {
+				int64_t sequence = frameLog.record_frame(this->now().nanoseconds(), inImage);
+				lastFrameSequence = sequence >= 0 ? sequence : FRAME_LOG_NO_FRAME;
+			}
 			return LocalizationStatus::OK;
 		}
 
@@ -178,6 +219,7 @@ class GlobalLocalizationNode : public rclcpp::Node{
 
 			// detect main marker location
 			std::vector<aruco::Marker> Markers = markerDetector.detect(inImage, cameraParameters, mainEnvMarker.ssize);
+			if (frameLog.is_open()) frameLog.record_detections(this->now().nanoseconds(), lastFrameSequence, mainEnvMarker.ssize, Markers);
 			temporaryMarker = aruco::Marker();
 			for (auto m:Markers) {
 				if (m.id == mainEnvMarker.id)
@@ -192,6 +234,7 @@ class GlobalLocalizationNode : public rclcpp::Node{
 
 			// detect backup marker location
 			Markers = markerDetector.detect(inImage, cameraParameters, backupEnvMarker.ssize);
+			if (frameLog.is_open()) frameLog.record_detections(this->now().nanoseconds(), lastFrameSequence, backupEnvMarker.ssize, Markers);
 			temporaryMarker = aruco::Marker();
 			for (auto m:Markers) {
 				if (m.id == backupEnvMarker.id)
@@ -220,6 +263,7 @@ class GlobalLocalizationNode : public rclcpp::Node{
 
 			// detect main marker location
 			std::vector<aruco::Marker> Markers = markerDetector.detect(inImage, cameraParameters, robotMarker.ssize);
+			if (frameLog.is_open()) frameLog.record_detections(this->now().nanoseconds(), lastFrameSequence, robotMarker.ssize, Markers);
 			temporaryMarker = aruco::Marker();
 			for (auto m:Markers) {
 				if (m.id == robotMarker.id)
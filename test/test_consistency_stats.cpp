@@ -0,0 +1,168 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+#include "minirys_global_localization/consistency_stats.hpp"
+
+static aruco::Marker make_marker(int id, float x, float rz){
+	aruco::Marker m(id);
+	float rvec[3] = {0, 0, rz}, tvec[3] = {x, 0, 2};
+	m.Rvec = cv::Mat(3, 1, CV_32FC1, rvec).clone();
+	m.Tvec = cv::Mat(3, 1, CV_32FC1, tvec).clone();
+	return m;
+}
+
+static cv::Vec4d quaternion(float x, float y, float z){
+	float rvec[3] = {x, y, z};
+	return rotation_quaternion(cv::Mat(3, 1, CV_32FC1, rvec));
+}
+
+TEST(StreamingStatsTest, MeanAndStddev){
+	StreamingStats stats;
+	for (double value:{2, 4, 4, 4, 5, 5, 7, 9}) stats.add(value);
+	EXPECT_EQ(stats.get_count(), 8u);
+	EXPECT_DOUBLE_EQ(stats.get_mean(), 5);
+	EXPECT_NEAR(stats.get_stddev(), std::sqrt(32.0/7), 1e-12);
+}
+
+TEST(StreamingStatsTest, PercentilesMatchExactValues){
+	std::mt19937 generator(1);
+	std::normal_distribution<double> normal(2.0, 0.01);
+	std::exponential_distribution<double> exponential(3);
+	StreamingStats normalStats, exponentialStats;
+	std::vector<double> normalValues, exponentialValues;
+	for (int i = 0; i < 100000; i++) {
+		normalValues.push_back(normal(generator));
+		exponentialValues.push_back(exponential(generator));
+		normalStats.add(normalValues.back());
+		exponentialStats.add(exponentialValues.back());
+	}
+
+	auto expect_percentiles = [](const StreamingStats &stats, std::vector<double> &values, double tolerance){
+		std::sort(values.begin(), values.end());
+		std::vector<double> estimates = stats.get_percentiles();
+		ASSERT_EQ(estimates.size(), PERCENTILES.size());
+		for (unsigned int i = 0; i < PERCENTILES.size(); i++) {
+			double exact = values[(size_t)(PERCENTILES[i]/100*(values.size() - 1))];
+			EXPECT_NEAR(estimates[i], exact, tolerance) << PERCENTILE_NAMES[i];
+		}
+	};
+	expect_percentiles(normalStats, normalValues, 1e-4);
+	expect_percentiles(exponentialStats, exponentialValues, 5e-3);
+}
+
+TEST(StreamingStatsTest, FewSamplesAreInterpolatedExactly){
+	StreamingStats stats;
+	for (double value:{3, 1, 2}) stats.add(value);
+	std::vector<double> percentiles = stats.get_percentiles();
+	EXPECT_DOUBLE_EQ(percentiles[0], 1);
+	EXPECT_DOUBLE_EQ(percentiles[1], 2);
+	EXPECT_DOUBLE_EQ(percentiles[2], 2.8);
+	EXPECT_DOUBLE_EQ(percentiles.back(), 3);
+
+	P2Quantile single(50);
+	single.add(7);
+	EXPECT_DOUBLE_EQ(single.value(), 7);
+}
+
+TEST(StreamingStatsTest, EmptyStatsHaveNoPercentiles){
+	StreamingStats stats;
+	EXPECT_EQ(stats.get_count(), 0u);
+	for (double value:stats.get_percentiles()) EXPECT_TRUE(std::isnan(value));
+	EXPECT_TRUE(std::isnan(P2Quantile(50).value()));
+}
+
+TEST(RotationTest, AngleNearPi){
+	EXPECT_NEAR(rotation_angle(quaternion(0, 0, 3.14f), quaternion(0, 0, -3.14f)), 2*M_PI - 6.28, 1e-6);
+	EXPECT_NEAR(rotation_angle(quaternion(0, 0, 3.14f), quaternion(0, 0, 3.14f)), 0, 1e-9);
+	EXPECT_NEAR(rotation_angle(quaternion(0, 0, 0), quaternion(0.5f, 0, 0)), 0.5, 1e-6);
+	EXPECT_NEAR(rotation_angle(quaternion(0, 0, 0.2f), quaternion(0, 0, -0.1f)), 0.3, 1e-6);
+}
+
+TEST(ConsistencyStatsTest, MarkersAndPairs){
+	ConsistencyStats consistency;
+	consistency.add_frame({make_marker(1, 0.5f, 3.1f), make_marker(0, 0.f, 3.1f)});
+	consistency.add_frame({make_marker(0, 0.f, -3.1f)});
+	consistency.add_frame({aruco::Marker(0)});
+
+	EXPECT_EQ(consistency.frames, 3u);
+	EXPECT_EQ(consistency.framesWithMarkers, 2u);
+	ASSERT_EQ(consistency.markers.size(), 2u);
+	EXPECT_EQ(consistency.markers[0].x.get_count(), 2u);
+	consistency.finish();
+	EXPECT_LT(consistency.markers[0].rotation.get_stats().get_percentiles().back(), 0.1);
+	ASSERT_EQ(consistency.pairs.size(), 1u);
+	EXPECT_NEAR(consistency.pairs[std::make_pair(0, 1)].distance.get_mean(), 0.5, 1e-6);
+	EXPECT_NEAR(consistency.pairs[std::make_pair(0, 1)].rotation.get_mean(), 0, 1e-6);
+
+	// markers rotated by 3.1 and -3.1 around z are 2*pi - 6.2 apart
+	ConsistencyStats flipped;
+	flipped.add_frame({make_marker(0, 0.f, 3.1f), make_marker(1, 0.5f, -3.1f)});
+	EXPECT_NEAR(flipped.pairs[std::make_pair(0, 1)].rotation.get_mean(), 2*M_PI - 6.2, 1e-5);
+}
+
+static FrameLogRecord detections(uint64_t session, uint32_t frameSequence, float markerSize, const std::vector<aruco::Marker> &markers){
+	FrameLogRecord record;
+	record.type = FrameLogRecordType::DETECTIONS_RECORD;
+	record.session = session;
+	record.frameSequence = frameSequence;
+	record.markerSize = markerSize;
+	record.markers = markers;
+	return record;
+}
+
+TEST(RecordedDetectionsTest, GroupsPassesByFrameAndSize){
+	// frames as recorded by the node - main and backup pass at 0.163, robot pass at 0.0385
+	std::vector<FrameLogRecord> records = {
+		detections(1, 0, 0.163f, {make_marker(0, 0, 0), make_marker(1, 0.5f, 0)}),
+		detections(1, 0, 0.163f, {make_marker(0, 0, 0), make_marker(1, 0.5f, 0)}),
+		detections(1, 1, 0.0385f, {make_marker(153, 0, 0)}),
+		detections(1, 2, 0.163f, {}),
+		detections(1, 2, 0.163f, {}),
+		detections(1, FRAME_LOG_NO_FRAME, 0.163f, {make_marker(0, 0, 0)}),
+		detections(2, 2, 0.163f, {make_marker(0, 0, 0)}),
+	};
+
+	RecordedDetections recorded(0.163f);
+	ConsistencyStats consistency;
+	std::vector<aruco::Marker> frameMarkers;
+	for (auto &record:records) {
+		if (recorded.add(record, frameMarkers)) consistency.add_frame(frameMarkers);
+	}
+	if (recorded.finish(frameMarkers)) consistency.add_frame(frameMarkers);
+
+	// empty passes count as frames without markers, same frame sequence in another session is another frame
+	EXPECT_EQ(consistency.frames, 3u);
+	EXPECT_EQ(consistency.framesWithMarkers, 2u);
+	EXPECT_EQ(consistency.markers[0].x.get_count(), 2u);
+	EXPECT_EQ(consistency.markers[1].x.get_count(), 1u);
+	EXPECT_EQ(consistency.markers.count(153), 0u);
+	EXPECT_EQ(recorded.other_size_records(), 1u);
+	EXPECT_EQ(recorded.unreferenced_records(), 1u);
+}
+
+TEST(RotationTest, ReferenceIgnoresFlippedFirstFrame){
+	RotationDeviation deviation;
+	// first observation is the other solution of planar pose ambiguity
+	deviation.add(quaternion(0.8f, 0, 0));
+	for (size_t i = 1; i < 2*ROTATION_REFERENCE_FRAMES; i++) deviation.add(quaternion(0, 0, i % 2 ? 0.01f : -0.01f));
+	deviation.finish();
+
+	const StreamingStats &stats = deviation.get_stats();
+	EXPECT_EQ(stats.get_count(), 2*ROTATION_REFERENCE_FRAMES);
+	std::vector<double> percentiles = stats.get_percentiles();
+	EXPECT_LT(percentiles[1], 0.021);
+	EXPECT_NEAR(percentiles.back(), 0.8, 0.01);
+}
+
+TEST(RotationTest, ReferenceFromFewFrames){
+	RotationDeviation deviation;
+	deviation.add(quaternion(0, 0, 0.1f));
+	deviation.add(quaternion(0, 0, 0.2f));
+	deviation.add(quaternion(0, 0, 0.3f));
+	EXPECT_EQ(deviation.get_stats().get_count(), 0u);
+	deviation.finish();
+	EXPECT_EQ(deviation.get_stats().get_count(), 3u);
+	EXPECT_NEAR(deviation.get_stats().get_percentiles().back(), 0.1, 1e-6);
+}
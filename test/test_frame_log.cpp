@@ -0,0 +1,196 @@
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "minirys_global_localization/frame_log.hpp"
+
+class FrameLogTest : public ::testing::Test{
+	protected:
+		std::string path;
+		std::vector<uint8_t> pixels;
+		cv::Mat frame;
+
+		void SetUp() override{
+			path = ::testing::TempDir() + "test_frame_log_" + std::to_string(getpid()) + ".ryslog";
+			std::remove(path.c_str());
+			pixels.resize(4*5*3);
+			for (size_t i = 0; i < pixels.size(); i++) pixels[i] = i;
+			frame = cv::Mat(4, 5, CV_8UC3, pixels.data());
+		}
+
+		void TearDown() override{
+			std::remove(path.c_str());
+		}
+
+		aruco::Marker make_marker(int id){
+			aruco::Marker m(id);
+			m.ssize = 0.163f;
+			for (int c = 0; c < 4; c++) m.push_back(cv::Point2f(c, 2*c));
+			float rvec[3] = {0.1f, 0.2f, 3.1f}, tvec[3] = {0.5f, -0.25f, 2.f};
+			m.Rvec = cv::Mat(3, 1, CV_32FC1, rvec).clone();
+			m.Tvec = cv::Mat(3, 1, CV_32FC1, tvec).clone();
+			return m;
+		}
+
+		// writes one frame with its detections and pose, returns session id
+		uint64_t write_session(){
+			FrameLogWriter writer;
+			EXPECT_TRUE(writer.open(path, 4, FrameLogWriter::frame_record_size(frame.rows, frame.cols, frame.type())));
+			int64_t sequence = writer.record_frame(100, frame);
+			EXPECT_GE(sequence, 0);
+			EXPECT_TRUE(writer.record_detections(200, sequence, 0.163f, {make_marker(0), aruco::Marker(3)}));
+			EXPECT_TRUE(writer.record_pose(300, sequence, 0, 1.f, 2.f, 3.f));
+			uint64_t session = writer.session_id();
+			writer.close();
+			EXPECT_EQ(writer.written_records(), 3u);
+			EXPECT_EQ(writer.dropped_records(), 0u);
+			return session;
+		}
+
+		std::vector<FrameLogRecord> read_all(){
+			FrameLogReader reader;
+			EXPECT_TRUE(reader.open(path));
+			std::vector<FrameLogRecord> records;
+			FrameLogRecord record;
+			while (reader.next(record)) {
+				// frame points into the mapping, copy it before the reader is closed
+				record.frame = record.frame.clone();
+				records.push_back(record);
+			}
+			return records;
+		}
+
+		void expect_session(const std::vector<FrameLogRecord> &records, size_t first, uint64_t session){
+			ASSERT_GE(records.size(), first + 4);
+			EXPECT_EQ(records[first].type, SESSION_RECORD);
+
+			const FrameLogRecord &frameRecord = records[first + 1];
+			EXPECT_EQ(frameRecord.type, FRAME_RECORD);
+			EXPECT_EQ(frameRecord.session, session);
+			EXPECT_EQ(frameRecord.timestampNs, 100);
+			ASSERT_EQ(frameRecord.frame.rows, 4);
+			ASSERT_EQ(frameRecord.frame.cols, 5);
+			EXPECT_EQ(frameRecord.frame.type(), CV_8UC3);
+			EXPECT_EQ(frameRecord.frame.ptr(3)[14], pixels[3*15 + 14]);
+
+			const FrameLogRecord &detections = records[first + 2];
+			EXPECT_EQ(detections.type, DETECTIONS_RECORD);
+			EXPECT_EQ(detections.session, session);
+			EXPECT_EQ(detections.frameSequence, frameRecord.sequence);
+			EXPECT_FLOAT_EQ(detections.markerSize, 0.163f);
+			ASSERT_EQ(detections.markers.size(), 2u);
+			EXPECT_EQ(detections.markers[0].id, 0);
+			EXPECT_FLOAT_EQ(detections.markers[0].ssize, 0.163f);
+			EXPECT_FLOAT_EQ(detections.markers[0][3].y, 6.f);
+			EXPECT_FLOAT_EQ(detections.markers[0].Rvec.ptr<float>(0)[2], 3.1f);
+			EXPECT_FLOAT_EQ(detections.markers[0].Tvec.ptr<float>(0)[1], -0.25f);
+			EXPECT_EQ(detections.markers[1].id, 3);
+			EXPECT_EQ(detections.markers[1].Tvec.total(), 0u);
+
+			const FrameLogRecord &pose = records[first + 3];
+			EXPECT_EQ(pose.type, POSE_RECORD);
+			EXPECT_EQ(pose.frameSequence, frameRecord.sequence);
+			EXPECT_EQ(pose.status, 0);
+			EXPECT_FLOAT_EQ(pose.x, 1.f);
+			EXPECT_FLOAT_EQ(pose.y, 2.f);
+			EXPECT_FLOAT_EQ(pose.theta, 3.f);
+		}
+};
+
+TEST_F(FrameLogTest, RoundTrip){
+	uint64_t session = write_session();
+	std::vector<FrameLogRecord> records = read_all();
+	EXPECT_EQ(records.size(), 4u);
+	expect_session(records, 0, session);
+}
+
+TEST_F(FrameLogTest, EmptyDetectionPass){
+	FrameLogWriter writer;
+	ASSERT_TRUE(writer.open(path, 4, 0));
+	int64_t sequence = writer.record_frame(100, frame);
+	EXPECT_TRUE(writer.record_detections(200, sequence, 0.0385f, {}));
+	writer.close();
+
+	// pass that found nothing still records marker size it was run with
+	std::vector<FrameLogRecord> records = read_all();
+	ASSERT_EQ(records.size(), 3u);
+	EXPECT_EQ(records[2].type, DETECTIONS_RECORD);
+	EXPECT_EQ(records[2].frameSequence, records[1].sequence);
+	EXPECT_FLOAT_EQ(records[2].markerSize, 0.0385f);
+	EXPECT_TRUE(records[2].markers.empty());
+}
+
+TEST_F(FrameLogTest, SmallRecordsDoNotTakeFrameBuffers){
+	FrameLogWriter writer;
+	ASSERT_TRUE(writer.open(path, 1, FrameLogWriter::frame_record_size(frame.rows, frame.cols, frame.type())));
+	for (size_t i = 0; i < FRAME_LOG_SMALL_BUFFERS_PER_FRAME; i++) EXPECT_TRUE(writer.record_pose(300, 0, 0, 1.f, 2.f, 3.f));
+	EXPECT_GE(writer.record_frame(100, frame), 0);
+	writer.close();
+	EXPECT_EQ(writer.dropped_records(), 0u);
+}
+
+TEST_F(FrameLogTest, TruncatedTail){
+	uint64_t session = write_session();
+	struct stat fileStat;
+	ASSERT_EQ(stat(path.c_str(), &fileStat), 0);
+
+	// cut pose record in half
+	ASSERT_EQ(truncate(path.c_str(), fileStat.st_size - FRAME_LOG_POSE_SIZE/2), 0);
+	std::vector<FrameLogRecord> records = read_all();
+	ASSERT_EQ(records.size(), 3u);
+	EXPECT_EQ(records[1].session, session);
+	EXPECT_EQ(records[2].type, DETECTIONS_RECORD);
+}
+
+TEST_F(FrameLogTest, AppendToExistingLog){
+	uint64_t firstSession = write_session();
+	struct stat fileStat;
+	ASSERT_EQ(stat(path.c_str(), &fileStat), 0);
+	ASSERT_EQ(truncate(path.c_str(), fileStat.st_size - FRAME_LOG_POSE_SIZE/2), 0);
+
+	// second session cuts off torn pose of the first one
+	uint64_t secondSession = write_session();
+	std::vector<FrameLogRecord> records = read_all();
+	ASSERT_EQ(records.size(), 7u);
+	EXPECT_EQ(records[2].session, firstSession);
+	expect_session(records, 3, secondSession);
+	EXPECT_EQ(records[4].sequence, records[1].sequence);
+}
+
+TEST_F(FrameLogTest, RejectsForeignFile){
+	std::FILE *file = std::fopen(path.c_str(), "wb");
+	ASSERT_NE(file, nullptr);
+	std::fputs("not a frame log", file);
+	std::fclose(file);
+
+	FrameLogWriter writer;
+	EXPECT_FALSE(writer.open(path, 4, 0));
+}
+
+TEST_F(FrameLogTest, ResyncAfterTornRecord){
+	uint64_t session = write_session();
+	struct stat fileStat;
+	ASSERT_EQ(stat(path.c_str(), &fileStat), 0);
+	std::vector<char> log(fileStat.st_size);
+	std::FILE *file = std::fopen(path.c_str(), "rb");
+	ASSERT_NE(file, nullptr);
+	ASSERT_EQ(std::fread(log.data(), 1, log.size(), file), log.size());
+	std::fclose(file);
+
+	// first session ends with torn frame record, records of a complete session follow it
+	std::vector<char> damaged(log);
+	size_t frameStart = FRAME_LOG_FILE_HEADER_SIZE + sizeof(FrameLogRecordHeader) + FRAME_LOG_SESSION_SIZE;
+	damaged.insert(damaged.end(), log.begin() + frameStart, log.begin() + frameStart + sizeof(FrameLogRecordHeader) + 10);
+	damaged.insert(damaged.end(), log.begin() + FRAME_LOG_FILE_HEADER_SIZE, log.end());
+	file = std::fopen(path.c_str(), "wb");
+	ASSERT_NE(file, nullptr);
+	ASSERT_EQ(std::fwrite(damaged.data(), 1, damaged.size(), file), damaged.size());
+	std::fclose(file);
+
+	std::vector<FrameLogRecord> records = read_all();
+	ASSERT_EQ(records.size(), 8u);
+	expect_session(records, 0, session);
+	expect_session(records, 4, session);
+}